@@ -0,0 +1,34 @@
+# Writes OUTPUT, a C++ source holding every file of FILES ('|'-separated) as a byte array
+# keyed by its path relative to SOURCE_DIR. Run with cmake -P from the build.
+string(REPLACE "|" ";" FILES "${FILES}")
+
+set(arrays "")
+set(entries "")
+set(index 0)
+foreach(path ${FILES})
+    file(RELATIVE_PATH name "${SOURCE_DIR}" "${path}")
+    file(READ "${path}" hex HEX)
+    string(LENGTH "${hex}" hex_length)
+    math(EXPR size "${hex_length} / 2")
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${hex}")
+    # Trailing zero terminates text assets and keeps empty files valid
+    string(APPEND arrays "static const unsigned char asset_${index}[] = {${bytes}0};\n")
+    string(APPEND entries "    {\"${name}\", asset_${index}, ${size}},\n")
+    math(EXPR index "${index} + 1")
+endforeach()
+
+file(WRITE "${OUTPUT}" "// Generated by cmake/EmbedAssets.cmake, do not edit
+#include <cstddef>
+
+struct EmbeddedAsset {
+    const char* path;
+    const unsigned char* data;
+    size_t size;
+};
+
+${arrays}
+extern const EmbeddedAsset lens_flare_embedded_assets[] = {
+${entries}    {nullptr, nullptr, 0}
+};
+extern const size_t lens_flare_embedded_asset_count = ${index};
+")
@@ -3,17 +3,46 @@
 in vec2 uv;
 out vec4 fragColor;
 
-uniform float aperture_opening;
-uniform float number_of_blades;
-uniform float time;
+#include "common/constants.glsl"
 
-void main() {
-    vec2 ndc = (uv - 0.5) * 2.0;
-    float dist = length(ndc);
+uniform int blades;        // fewer than 3 gives a circular opening
+uniform float opening;     // circumradius in stop coordinates
+uniform float curvature;   // 0 = straight blades, 1 = circular opening
+uniform float rotation;    // radians
+uniform float pixel_size;  // stop coordinates per texel
+uniform sampler2D imperfection_texture; // dust, scratch and grating transmission
+uniform bool imperfections;
+
+// Signed distance to the opening edge, negative inside.
+// Every blade is a disc whose rim passes through the two neighbouring polygon vertices; the
+// opening is the intersection of the discs, so curvature 0 is the polygon and 1 the circle
+float apertureDistance(vec2 p) {
+    if (blades < 3) {
+        return length(p) - opening;
+    }
+    
+    float half_angle = PI / float(blades);
+    float apothem = opening * cos(half_angle);
+    float half_edge = opening * sin(half_angle);
+    float radius = opening / max(curvature, 1e-3);
+    float offset = sqrt(max(radius * radius - half_edge * half_edge, 0.0)) - apothem;
     
-    // Simple circular aperture
-    float aperture_mask = smoothstep(0.8, 0.7, dist);
+    float d = -1e9;
+    for (int k = 0; k < blades; ++k) {
+        float angle = rotation + float(2 * k + 1) * half_angle;
+        vec2 normal = vec2(cos(angle), sin(angle));
+        d = max(d, curvature < 1e-3 ? dot(p, normal) - apothem : length(p + offset * normal) - radius);
+    }
+    return d;
+}
+
+void main() {
+    vec2 p = (uv - 0.5) * 2.0;
     
-    vec3 rgb = vec3(aperture_mask);
-    fragColor = vec4(rgb, 1.0);
-}
\ No newline at end of file
+    // Box-filtered coverage of the texel, from the distance to the edge
+    float coverage = clamp(0.5 - apertureDistance(p) / pixel_size, 0.0, 1.0);
+    if (imperfections) {
+        coverage *= texture(imperfection_texture, uv).r;
+    }
+    fragColor = vec4(coverage, 0.0, 0.0, 1.0);
+}
@@ -0,0 +1,9 @@
+// Approximate white balance for a black body light source of the given temperature in K
+vec3 temperatureToColor(float temp) {
+    float t = temp / 6000.0;
+    vec3 color;
+    color.r = clamp(1.0 + 0.1 * (t - 1.0), 0.6, 1.0);
+    color.g = clamp(0.9 + 0.05 * (t - 1.0), 0.8, 1.0);
+    color.b = clamp(0.8 + 0.2 * (1.0 - t), 0.5, 1.0);
+    return color;
+}
@@ -0,0 +1 @@
+#define PI 3.14159265359
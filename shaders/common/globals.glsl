@@ -0,0 +1,16 @@
+// Mirrors GlobalUniforms in opengl_lens_flare.cpp
+layout(std140, binding = 0) uniform GlobalUniforms {
+    float time;
+    float spread;
+    float plate_size;
+    float aperture_id;
+    float num_interfaces;
+    float coating_quality;
+    vec2 backbuffer_size;
+    vec3 light_dir; // brightest light of the frame
+    float aperture_resolution;
+    float aperture_opening;
+    float number_of_blades;
+    float starburst_resolution;
+    float padding;
+};
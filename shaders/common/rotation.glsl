@@ -0,0 +1,13 @@
+// Azimuthal rotation of ghost patches about the optical axis: meridional traces are drawn
+// at the light's azimuth, and TraceCache in opengl_lens_flare.cpp rotates cached patches;
+// rotation holds the cosine and sine of the angle
+
+vec2 rotateAboutAxis(vec2 p, vec2 rotation) {
+    return vec2(p.x * rotation.x - p.y * rotation.y, p.x * rotation.y + p.y * rotation.x);
+}
+
+// Sensor positions are in NDC, so they are rotated in aspect-corrected units
+vec2 rotateSensorPosition(vec2 ndc, vec2 rotation, float aspect_ratio) {
+    vec2 p = rotateAboutAxis(vec2(ndc.x * aspect_ratio, ndc.y), rotation);
+    return vec2(p.x / aspect_ratio, p.y);
+}
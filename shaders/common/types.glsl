@@ -0,0 +1,48 @@
+// Buffer structs shared with the C++ side; opengl_lens_flare.cpp checks their sizes
+
+struct LensInterface {
+    vec3 center;
+    float radius;
+    vec3 n; // n.x = left IOR, n.y = coating IOR, n.z = right IOR
+    float sa; // surface aperture
+    float d1; // coating thickness
+    float is_flat; // flat surface flag (renamed to avoid keyword conflict)
+    float pos; // position along optical axis
+    float w; // width factor
+};
+
+struct GhostData {
+    float bounce1;
+    float bounce2;
+    float bounce3; // -1 when unused
+    float bounce4; // -1 when unused
+};
+
+struct GhostVertex {
+    vec4 position; // xy = sensor position in NDC, zw = coordinate on the aperture stop
+    vec4 params;   // x = Fresnel transmittance, y = max relative radius along the path, z = area ratio
+};
+
+// Screen-space footprint of each ghost, written by the trace pass and consumed by the cull pass
+struct GhostBounds {
+    ivec4 bbox;  // fixed-point NDC min.xy, max.xy of the lit vertices
+    uvec4 stats; // x = mean intensity in 2.30 fixed point, y = lit vertex count, z = kept quads
+};
+
+#define BOUNDS_SCALE 4096.0
+
+// One light of the frame; ghost patches are stored light by light, num_ghosts per light
+struct LightSource {
+    vec4 direction; // xyz = direction towards the light in the camera frame, w = intensity
+    vec4 spectrum;  // rgb = linear tint of its ghosts
+    vec4 rotation;  // xy = cosine and sine of the azimuth its patches are drawn rotated by
+};
+
+// Matches the layout glMultiDrawElementsIndirect expects
+struct DrawElementsIndirectCommand {
+    uint count;
+    uint instance_count;
+    uint first_index;
+    int base_vertex;
+    uint base_instance;
+};
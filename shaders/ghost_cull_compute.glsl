@@ -0,0 +1,80 @@
+#version 430
+
+layout(local_size_x = 64) in;
+
+#include "common/types.glsl"
+#include "common/rotation.glsl"
+
+layout(std430, binding = 3) buffer GhostBoundsBuffer {
+    GhostBounds ghost_bounds[];
+};
+
+// draw_count doubles as the parameter buffer for the indirect-count draw
+layout(std430, binding = 4) buffer GhostDrawBuffer {
+    uint draw_count;
+    uint draw_padding[3];
+    DrawElementsIndirectCommand draw_commands[];
+};
+
+layout(std430, binding = 7) readonly buffer LightBuffer {
+    LightSource lights[];
+};
+
+uniform int num_ghosts; // per light
+uniform int num_patches; // one per (light, ghost)
+uniform int vertices_per_ghost;
+uniform int index_count;
+uniform bool compacted_quads; // draw the per-patch ranges of the compacted quad list
+uniform float min_intensity; // ghosts dimmer than this on average are not drawn
+uniform float aspect_ratio;
+
+void main() {
+    uint patch_id = gl_GlobalInvocationID.x;
+    if (patch_id >= uint(num_patches)) {
+        return;
+    }
+    
+    GhostBounds bounds = ghost_bounds[patch_id];
+    LightSource light = lights[patch_id / uint(num_ghosts)];
+    vec2 patch_rotation = light.rotation.xy;
+    
+    // The quad counter is consumed here so the next classification starts from zero
+    ghost_bounds[patch_id].stats.z = 0u;
+    
+    // Nothing reached the sensor through the stop
+    if (bounds.stats.y == 0u) {
+        return;
+    }
+    
+    // Entirely outside the viewport; a rotated patch is bounded by its rotated box
+    vec4 box = vec4(bounds.bbox) / BOUNDS_SCALE;
+    if (patch_rotation != vec2(1.0, 0.0)) {
+        vec2 c0 = rotateSensorPosition(box.xy, patch_rotation, aspect_ratio);
+        vec2 c1 = rotateSensorPosition(box.zy, patch_rotation, aspect_ratio);
+        vec2 c2 = rotateSensorPosition(box.xw, patch_rotation, aspect_ratio);
+        vec2 c3 = rotateSensorPosition(box.zw, patch_rotation, aspect_ratio);
+        box = vec4(min(min(c0, c1), min(c2, c3)), max(max(c0, c1), max(c2, c3)));
+    }
+    if (box.z < -1.0 || box.x > 1.0 || box.w < -1.0 || box.y > 1.0) {
+        return;
+    }
+    
+    // Too dim to contribute at the light's intensity
+    float mean_intensity = float(bounds.stats.x) / 1073741824.0 * light.direction.w;
+    if (mean_intensity < min_intensity) {
+        return;
+    }
+    
+    uint count = uint(index_count);
+    uint first_index = 0u;
+    if (compacted_quads) {
+        if (bounds.stats.z == 0u) {
+            return;
+        }
+        count = bounds.stats.z * 6u;
+        first_index = patch_id * uint(index_count);
+    }
+    
+    uint slot = atomicAdd(draw_count, 1u);
+    draw_commands[slot] = DrawElementsIndirectCommand(count, 1u, first_index, int(patch_id) * vertices_per_ghost, patch_id);
+}
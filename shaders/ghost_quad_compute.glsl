@@ -0,0 +1,133 @@
+#version 430
+
+layout(local_size_x = 16, local_size_y = 16) in;
+
+#include "common/types.glsl"
+
+layout(std430, binding = 2) readonly buffer VertexDataBuffer {
+    GhostVertex vertex_data[];
+};
+
+layout(std430, binding = 3) buffer GhostBoundsBuffer {
+    GhostBounds ghost_bounds[];
+};
+
+// Compacted triangle list, (patch_tessellation - 1)^2 * 6 slots per ghost, grid-relative indices
+layout(std430, binding = 5) writeonly buffer QuadIndexBuffer {
+    uint quad_indices[];
+};
+
+#define QUAD_KEPT 0
+#define QUAD_MISSED 1
+#define QUAD_CLIPPED 2
+#define QUAD_DEGENERATE 3
+#define QUAD_FOLDED 4
+#define QUAD_CLASSES 5
+
+layout(std430, binding = 6) buffer QuadStatsBuffer {
+    uint quad_stats[QUAD_CLASSES];
+};
+
+uniform int patch_tessellation;
+uniform vec2 viewport_size;
+uniform float min_quad_area; // pixels^2
+uniform bool cull_folded;
+uniform int patch_offset; // first patch of this dispatch
+
+shared uint s_count;
+shared uint s_base;
+shared uint s_classes[QUAD_CLASSES];
+
+// A vertex whose fragments are all discarded: clipped by some interface or outside the stop
+bool isClipped(GhostVertex v) {
+    return v.params.y > 1.0 || any(greaterThan(abs(v.position.zw), vec2(1.0)));
+}
+
+float signedArea(vec2 a, vec2 b, vec2 c) {
+    return 0.5 * ((b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y));
+}
+
+int classifyQuad(GhostVertex v00, GhostVertex v10, GhostVertex v01, GhostVertex v11) {
+    // Rays that missed an interface have no meaningful sensor position
+    if (min(min(v00.params.x, v10.params.x), min(v01.params.x, v11.params.x)) <= 0.0) {
+        return QUAD_MISSED;
+    }
+    
+    // Clip radius and stop coordinate interpolate linearly, so a quad is only
+    // entirely discarded when all four corners are; partial quads keep the smooth edge
+    if (isClipped(v00) && isClipped(v10) && isClipped(v01) && isClipped(v11)) {
+        return QUAD_CLIPPED;
+    }
+    
+    vec2 half_viewport = viewport_size * 0.5;
+    vec2 p00 = v00.position.xy * half_viewport;
+    vec2 p10 = v10.position.xy * half_viewport;
+    vec2 p01 = v01.position.xy * half_viewport;
+    vec2 p11 = v11.position.xy * half_viewport;
+    float a0 = signedArea(p00, p10, p01);
+    float a1 = signedArea(p10, p11, p01);
+    
+    if (abs(a0) + abs(a1) < min_quad_area) {
+        return QUAD_DEGENERATE;
+    }
+    
+    // The two triangles face opposite ways: the patch folds over itself inside this quad
+    if (cull_folded && a0 * a1 < 0.0) {
+        return QUAD_FOLDED;
+    }
+    
+    return QUAD_KEPT;
+}
+
+void main() {
+    uint p = uint(patch_tessellation);
+    uint quads_per_row = p - 1u;
+    uint x = gl_GlobalInvocationID.x;
+    uint y = gl_GlobalInvocationID.y;
+    uint ghost_id = uint(patch_offset) + gl_WorkGroupID.z;
+    
+    if (gl_LocalInvocationIndex < uint(QUAD_CLASSES)) {
+        s_classes[gl_LocalInvocationIndex] = 0u;
+    }
+    if (gl_LocalInvocationIndex == 0u) {
+        s_count = 0u;
+    }
+    barrier();
+    
+    bool keep = false;
+    uint slot = 0u;
+    uint v00_idx = y * p + x;
+    if (x < quads_per_row && y < quads_per_row && ghost_id < uint(ghost_bounds.length())) {
+        uint ghost_base = ghost_id * p * p;
+        int quad_class = classifyQuad(vertex_data[ghost_base + v00_idx], vertex_data[ghost_base + v00_idx + 1u],
+                                      vertex_data[ghost_base + v00_idx + p], vertex_data[ghost_base + v00_idx + p + 1u]);
+        atomicAdd(s_classes[quad_class], 1u);
+        keep = quad_class == QUAD_KEPT;
+        if (keep) {
+            slot = atomicAdd(s_count, 1u);
+        }
+    }
+    barrier();
+    
+    // One global reservation per workgroup in the ghost's index range
+    if (gl_LocalInvocationIndex == 0u && s_count > 0u) {
+        s_base = atomicAdd(ghost_bounds[ghost_id].stats.z, s_count);
+    }
+    if (gl_LocalInvocationIndex < uint(QUAD_CLASSES) && s_classes[gl_LocalInvocationIndex] > 0u) {
+        atomicAdd(quad_stats[gl_LocalInvocationIndex], s_classes[gl_LocalInvocationIndex]);
+    }
+    barrier();
+    
+    if (keep) {
+        uint offset = (ghost_id * quads_per_row * quads_per_row + s_base + slot) * 6u;
+        uint v10_idx = v00_idx + 1u;
+        uint v01_idx = v00_idx + p;
+        uint v11_idx = v01_idx + 1u;
+        quad_indices[offset + 0u] = v00_idx;
+        quad_indices[offset + 1u] = v10_idx;
+        quad_indices[offset + 2u] = v01_idx;
+        quad_indices[offset + 3u] = v10_idx;
+        quad_indices[offset + 4u] = v11_idx;
+        quad_indices[offset + 5u] = v01_idx;
+    }
+}
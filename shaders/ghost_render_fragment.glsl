@@ -1,25 +1,19 @@
 #version 430 core
 
 in float intensity;
+in float clip_radius;
 in vec2 aperture_coord;
+flat in vec3 ghost_color;
 
 uniform sampler2D aperture_texture;
-uniform vec3 ghost_color;
 uniform float time;
 
 out vec4 fragColor;
 
-vec3 temperatureToColor(float temp) {
-    float t = temp / 6000.0;
-    vec3 color;
-    color.r = clamp(1.0 + 0.1 * (t - 1.0), 0.6, 1.0);
-    color.g = clamp(0.9 + 0.05 * (t - 1.0), 0.8, 1.0);
-    color.b = clamp(0.8 + 0.2 * (1.0 - t), 0.5, 1.0);
-    return color;
-}
+#include "common/color.glsl"
 
 void main() {
-    if (intensity <= 0.0) {
+    if (intensity <= 0.0 || clip_radius > 1.0) {
         discard;
     }
     
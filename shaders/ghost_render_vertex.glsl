@@ -1,57 +1,90 @@
 #version 430 core
 
+#include "common/constants.glsl"
+#include "common/types.glsl"
+#include "common/rotation.glsl"
+
 // Input from SSBO (vertex data computed by ray tracing)
 layout(std430, binding = 2) readonly buffer VertexDataBuffer {
-    vec4 vertex_data[]; // x, y, intensity, w
+    GhostVertex vertex_data[];
+};
+
+layout(std430, binding = 7) readonly buffer LightBuffer {
+    LightSource lights[];
 };
 
-uniform float ghost_id;
+uniform float ghost_id; // patch of the expanded draws only
+uniform int num_ghosts; // per light
 uniform int patch_tessellation;
+uniform float exposure;
+uniform float aspect_ratio;
 
 out float intensity;
+out float clip_radius;
 out vec2 aperture_coord;
+flat out vec3 ghost_color;
+
+uniform bool indexed_mesh; // gl_VertexID is a grid vertex (base vertex selects the ghost)
 
 void main() {
     int total_vertices_per_ghost = patch_tessellation * patch_tessellation;
+    int vertex_idx;
+    int ghost = int(ghost_id);
     
-    // For each triangle (6 vertices per quad), map to the underlying grid
-    int triangle_id = gl_VertexID / 6;  // Which quad triangle are we in
-    int vertex_in_triangle = gl_VertexID % 6;  // Which vertex of the triangle
-    
-    // Map triangle to grid coordinates
-    int grid_x = triangle_id % (patch_tessellation - 1);
-    int grid_y = triangle_id / (patch_tessellation - 1);
-    
-    // Define the quad vertices (2 triangles)
-    ivec2 quad_offsets[6] = ivec2[](
-        ivec2(0, 0), ivec2(1, 0), ivec2(0, 1),  // First triangle
-        ivec2(1, 0), ivec2(1, 1), ivec2(0, 1)   // Second triangle
-    );
-    
-    ivec2 offset = quad_offsets[vertex_in_triangle];
-    int local_x = grid_x + offset.x;
-    int local_y = grid_y + offset.y;
-    
-    // Clamp to valid range
-    local_x = min(local_x, patch_tessellation - 1);
-    local_y = min(local_y, patch_tessellation - 1);
+    if (indexed_mesh) {
+        // Static index buffer addresses the grid directly, so each vertex is fetched once
+        // and shared triangles hit the post-transform cache. The base vertex of the draw
+        // selects the (light, ghost) patch, which lets culled patches be dropped from one
+        // indirect multi-draw.
+        vertex_idx = gl_VertexID;
+        ghost = gl_VertexID / total_vertices_per_ghost;
+    } else {
+        // For each triangle (6 vertices per quad), map to the underlying grid
+        int triangle_id = gl_VertexID / 6;  // Which quad triangle are we in
+        int vertex_in_triangle = gl_VertexID % 6;  // Which vertex of the triangle
+        
+        // Map triangle to grid coordinates
+        int grid_x = triangle_id % (patch_tessellation - 1);
+        int grid_y = triangle_id / (patch_tessellation - 1);
+        
+        // Define the quad vertices (2 triangles)
+        ivec2 quad_offsets[6] = ivec2[](
+            ivec2(0, 0), ivec2(1, 0), ivec2(0, 1),  // First triangle
+            ivec2(1, 0), ivec2(1, 1), ivec2(0, 1)   // Second triangle
+        );
+        
+        ivec2 offset = quad_offsets[vertex_in_triangle];
+        int local_x = min(grid_x + offset.x, patch_tessellation - 1);
+        int local_y = min(grid_y + offset.y, patch_tessellation - 1);
+        
+        int vertex_in_ghost = local_y * patch_tessellation + local_x;
+        vertex_idx = ghost * total_vertices_per_ghost + vertex_in_ghost;
+    }
     
-    int vertex_in_ghost = local_y * patch_tessellation + local_x;
-    int vertex_idx = int(ghost_id) * total_vertices_per_ghost + vertex_in_ghost;
+    // Simple per-ghost color variation, golden ratio hue steps, tinted by the light's spectrum
+    LightSource light = lights[ghost / num_ghosts];
+    float hue = float(ghost % num_ghosts) * 0.137;
+    ghost_color = 0.5 + 0.5 * sin((vec3(hue) + vec3(0.0, 0.33, 0.66)) * 2.0 * PI);
+    ghost_color *= light.spectrum.rgb;
+    vec2 patch_rotation = light.rotation.xy;
     
     if (vertex_idx >= vertex_data.length()) {
         gl_Position = vec4(0.0, 0.0, -10.0, 1.0); // Cull this vertex
         intensity = 0.0;
+        clip_radius = 0.0;
         aperture_coord = vec2(0.0);
         return;
     }
     
-    vec4 vertex = vertex_data[vertex_idx];
+    GhostVertex vertex = vertex_data[vertex_idx];
     
-    // Convert from compute shader screen space to clip space
-    gl_Position = vec4(vertex.xy, 0.0, 1.0);
-    intensity = vertex.z;
+    // Sensor position is already in clip space
+    gl_Position = vec4(rotateSensorPosition(vertex.position.xy, patch_rotation, aspect_ratio), 0.0, 1.0);
+    // Irradiance: path transmittance times the beam's area compression onto the sensor
+    intensity = vertex.params.x * vertex.params.z * light.direction.w * exposure;
+    clip_radius = vertex.params.y;
     
-    // Calculate aperture coordinate for texture lookup
-    aperture_coord = (vec2(local_x, local_y) / float(patch_tessellation - 1) - 0.5) * 2.0;
-}
\ No newline at end of file
+    // Traced coordinate on the aperture stop for the mask lookup; the blades do not
+    // turn with the light, so a rotated patch crosses the stop at rotated coordinates
+    aperture_coord = rotateAboutAxis(vertex.position.zw, patch_rotation);
+}
@@ -2,39 +2,9 @@
 
 layout(local_size_x = 16, local_size_y = 16) in;
 
-layout(std140, binding = 0) uniform GlobalUniforms {
-    float time;
-    float spread;
-    float plate_size;
-    float aperture_id;
-    float num_interfaces;
-    float coating_quality;
-    vec2 backbuffer_size;
-    vec3 light_dir;
-    float aperture_resolution;
-    float aperture_opening;
-    float number_of_blades;
-    float starburst_resolution;
-    float padding;
-};
-
-struct LensInterface {
-    vec3 center;
-    float radius;
-    vec3 n; // n.x = left IOR, n.y = coating IOR, n.z = right IOR
-    float sa; // surface aperture
-    float d1; // coating thickness
-    float is_flat; // flat surface flag (renamed to avoid keyword conflict)
-    float pos; // position along optical axis
-    float w; // width factor
-};
-
-struct GhostData {
-    float bounce1;
-    float bounce2;
-    float padding1;
-    float padding2;
-};
+#include "common/constants.glsl"
+#include "common/globals.glsl"
+#include "common/types.glsl"
 
 layout(std430, binding = 0) readonly buffer LensInterfaceBuffer {
     LensInterface lens_interfaces[];
@@ -45,136 +15,456 @@ layout(std430, binding = 1) readonly buffer GhostDataBuffer {
 };
 
 layout(std430, binding = 2) writeonly buffer VertexDataBuffer {
-    vec4 vertex_data[];
+    GhostVertex vertex_data[];
 };
 
+layout(std430, binding = 3) buffer GhostBoundsBuffer {
+    GhostBounds ghost_bounds[];
+};
+
+layout(std430, binding = 7) readonly buffer LightBuffer {
+    LightSource lights[];
+};
+
+#define BOUNDS_LIMIT 16.0
+
 uniform sampler2D aperture_texture;
+uniform int patch_tessellation;
+uniform float wavelength; // nm
+uniform bool persistent_threads;
+uniform bool meridional; // trace the upper half of the patch in the meridional frame and mirror it
+uniform int num_lights;
+uniform float energy_scale; // 2^30 / vertices per ghost, so the sum over a ghost is its mean intensity
 
-// Ray-sphere intersection
-bool intersectSphere(vec3 rayOrigin, vec3 rayDir, vec3 sphereCenter, float sphereRadius, out float t) {
-    vec3 oc = rayOrigin - sphereCenter;
-    float a = dot(rayDir, rayDir);
-    float b = 2.0 * dot(oc, rayDir);
-    float c = dot(oc, oc) - sphereRadius * sphereRadius;
-    float discriminant = b * b - 4 * a * c;
-    
-    if (discriminant < 0) return false;
-    
-    float sqrt_discriminant = sqrt(discriminant);
-    float t1 = (-b - sqrt_discriminant) / (2 * a);
-    float t2 = (-b + sqrt_discriminant) / (2 * a);
-    
-    t = (t1 > 0) ? t1 : t2;
-    return t > 0;
+#define MAX_BOUNCES 4
+
+#if defined(LENS_SPECIALISED)
+// Lens table baked into the kernel by the variant generator
+const vec4 k_surface[NUM_LENS_INTERFACES] = vec4[](LENS_SURFACE_DATA); // center.z, radius, pos, sa
+const vec4 k_coating[NUM_LENS_INTERFACES] = vec4[](LENS_COATING_DATA); // n.x, n.y, n.z, d1
+#define LENS_COUNT NUM_LENS_INTERFACES
+#define STOP_INDEX APERTURE_INDEX
+#define GHOST_COUNT uint(NUM_GHOSTS)
+#else
+#define LENS_COUNT lens_interfaces.length()
+#define STOP_INDEX int(aperture_id)
+#define GHOST_COUNT uint(ghost_data.length())
+#endif
+
+#if defined(LENS_TABLE_SHARED) && !defined(LENS_SPECIALISED)
+// Lens table staged once per workgroup in packed SoA form
+#define MAX_LENS_INTERFACES 64
+shared vec4 s_surface[MAX_LENS_INTERFACES]; // center.z, radius, pos, sa
+shared vec4 s_coating[MAX_LENS_INTERFACES]; // n.x, n.y, n.z, d1
+shared uint s_flat_mask[MAX_LENS_INTERFACES / 32];
+#endif
+
+// Cooperatively copies the lens table into shared memory (must be called in uniform control flow)
+void stageLensTable() {
+#if defined(LENS_TABLE_SHARED) && !defined(LENS_SPECIALISED)
+    uint count = min(uint(lens_interfaces.length()), uint(MAX_LENS_INTERFACES));
+    uint group_size = gl_WorkGroupSize.x * gl_WorkGroupSize.y;
+    for (uint i = gl_LocalInvocationIndex; i < count; i += group_size) {
+        LensInterface F = lens_interfaces[i];
+        s_surface[i] = vec4(F.center.z, F.radius, F.pos, F.sa);
+        s_coating[i] = vec4(F.n, F.d1);
+    }
+    if (gl_LocalInvocationIndex < uint(MAX_LENS_INTERFACES / 32)) {
+        uint mask = 0u;
+        for (uint j = 0u; j < 32u; ++j) {
+            uint idx = gl_LocalInvocationIndex * 32u + j;
+            if (idx < count && lens_interfaces[idx].is_flat > 0.5) mask |= 1u << j;
+        }
+        s_flat_mask[gl_LocalInvocationIndex] = mask;
+    }
+    barrier();
+#endif
 }
 
-// Ray-plane intersection  
-bool intersectPlane(vec3 rayOrigin, vec3 rayDir, vec3 planeCenter, vec3 planeNormal, out float t) {
-    float denom = dot(planeNormal, rayDir);
-    if (abs(denom) < 1e-6) return false;
+LensInterface fetchInterface(int i) {
+#if defined(LENS_SPECIALISED)
+    // With ghost tiles every thread of a workgroup traces the same ghost, so i is
+    // uniform and the flat/spherical selection below never diverges. A persistent
+    // chunk can span ghosts, whose lanes may then index different interfaces
+    LensInterface F;
+    vec4 surface = k_surface[i];
+    vec4 coating = k_coating[i];
+    F.center = vec3(0.0, 0.0, surface.x);
+    F.radius = surface.y;
+    F.pos = surface.z;
+    F.sa = surface.w;
+    F.n = coating.xyz;
+    F.d1 = coating.w;
+    uint flat_bits = (i < 32) ? (LENS_FLAT_MASK_LO >> uint(i)) : (LENS_FLAT_MASK_HI >> uint(i - 32));
+    F.is_flat = float(flat_bits & 1u);
+    F.w = 0.0;
+    return F;
+#elif defined(LENS_TABLE_SHARED)
+    LensInterface F;
+    vec4 surface = s_surface[i];
+    vec4 coating = s_coating[i];
+    F.center = vec3(0.0, 0.0, surface.x);
+    F.radius = surface.y;
+    F.pos = surface.z;
+    F.sa = surface.w;
+    F.n = coating.xyz;
+    F.d1 = coating.w;
+    F.is_flat = float((s_flat_mask[i >> 5] >> uint(i & 31)) & 1u);
+    F.w = 0.0;
+    return F;
+#else
+    return lens_interfaces[i];
+#endif
+}
+
+struct Ray {
+    vec3 pos;
+    vec3 dir;
+};
+
+struct Intersection {
+    vec3 pos;
+    vec3 norm;
+    float theta;
+    bool hit;
+};
+
+// Ray-sphere intersection picking the cap that contains the interface vertex
+Intersection testSphere(Ray r, LensInterface F) {
+    Intersection i;
+    vec3 D = r.pos - F.center;
+    float B = dot(D, r.dir);
+    float C = dot(D, D) - F.radius * F.radius;
+    float B2_C = B * B - C;
     
-    vec3 p0l0 = planeCenter - rayOrigin;
-    t = dot(p0l0, planeNormal) / denom;
-    return t >= 0;
+    if (B2_C < 0.0) {
+        i.hit = false;
+        return i;
+    }
+    
+    float sgn = (F.radius * r.dir.z) > 0.0 ? -1.0 : 1.0;
+    float t = sgn * sqrt(B2_C) - B;
+    i.pos = r.pos + r.dir * t;
+    i.norm = normalize(i.pos - F.center);
+    if (dot(i.norm, r.dir) > 0.0) i.norm = -i.norm;
+    i.theta = acos(clamp(dot(-r.dir, i.norm), -1.0, 1.0));
+    i.hit = t > 0.0;
+    return i;
 }
 
-// Fresnel reflectance
-float fresnel(float cosTheta, float n1, float n2) {
-    float r0 = (n1 - n2) / (n1 + n2);
-    r0 = r0 * r0;
-    float cosX = 1.0 - cosTheta;
-    return r0 + (1.0 - r0) * pow(cosX, 5.0);
+// Ray-plane intersection for flat interfaces perpendicular to the optical axis
+Intersection testFlat(Ray r, LensInterface F) {
+    Intersection i;
+    float t = (F.pos - r.pos.z) / r.dir.z;
+    i.pos = r.pos + r.dir * t;
+    i.norm = vec3(0.0, 0.0, r.dir.z > 0.0 ? -1.0 : 1.0);
+    i.theta = acos(clamp(abs(r.dir.z), -1.0, 1.0));
+    i.hit = t > 0.0;
+    return i;
 }
 
-void main() {
-    uvec3 thread_id = gl_GlobalInvocationID;
-    uint ghost_id = thread_id.x / 16; // Each group handles one ghost
+// Reflectance of an interface with a single-layer anti-reflective coating
+float fresnelAR(float theta0, float lambda, float d1, float n0, float n1, float n2) {
+    // Refraction angles in the coating and the second medium
+    float s0 = sin(theta0);
+    float s1 = s0 * n0 / n1;
+    float s2 = s0 * n0 / n2;
+    float c0 = cos(theta0);
+    float c1 = sqrt(max(1.0 - s1 * s1, 0.0));
+    float c2 = sqrt(max(1.0 - s2 * s2, 0.0));
     
-    if (ghost_id >= ghost_data.length()) return;
+    // Amplitudes for the outer reflection on the topmost interface
+    float rs01 = (n0 * c0 - n1 * c1) / (n0 * c0 + n1 * c1);
+    float rp01 = (n1 * c0 - n0 * c1) / (n1 * c0 + n0 * c1);
     
-    // Get local coordinates within the patch
-    uint local_x = thread_id.x % 16;
-    uint local_y = thread_id.y;
+    // Amplitudes for the inner reflection
+    float rs12 = (n1 * c1 - n2 * c2) / (n1 * c1 + n2 * c2);
+    float rp12 = (n2 * c1 - n1 * c2) / (n2 * c1 + n1 * c2);
     
-    if (local_x >= 16 || local_y >= 16) return;
+    // After passing the coating twice: two transmissions and one reflection
+    float ris = (1.0 - rs01 * rs01) * rs12;
+    float rip = (1.0 - rp01 * rp01) * rp12;
     
-    GhostData ghost = ghost_data[ghost_id];
-    uint bounce1_idx = uint(ghost.bounce1);
-    uint bounce2_idx = uint(ghost.bounce2);
+    // Phase difference between outer and inner reflections
+    float rel_phase = 4.0 * PI * n1 * d1 * c1 / lambda;
     
-    if (bounce1_idx >= lens_interfaces.length() || bounce2_idx >= lens_interfaces.length()) return;
+    float out_s2 = rs01 * rs01 + ris * ris + 2.0 * rs01 * ris * cos(rel_phase);
+    float out_p2 = rp01 * rp01 + rip * rip + 2.0 * rp01 * rip * cos(rel_phase);
+    return (out_s2 + out_p2) * 0.5;
+}
+
+// Sequential trace: forward to bounce1, backward to bounce2, forward to the sensor
+// (and again for the optional second pair of a higher-order ghost)
+GhostVertex traceGhost(Ray r, GhostData ghost) {
+    int bounces[MAX_BOUNCES] = int[](int(ghost.bounce1), int(ghost.bounce2), int(ghost.bounce3), int(ghost.bounce4));
+    int num_bounces = 0;
+    while (num_bounces < MAX_BOUNCES && bounces[num_bounces] >= 0) ++num_bounces;
     
-    // Generate ray from light source
-    vec2 aperture_coord = (vec2(local_x, local_y) / 16.0 - 0.5) * 2.0;
-    vec3 ray_origin = vec3(aperture_coord * 10.0, -100.0); // Start far behind lens
-    vec3 ray_dir = normalize(light_dir);
+    int num_lens = LENS_COUNT;
+    int stop = STOP_INDEX;
+    int sensor = num_lens - 1;
     
-    vec3 current_pos = ray_origin;
-    vec3 current_dir = ray_dir;
-    float intensity = 1.0;
+    GhostVertex v;
+    v.position = vec4(0.0);
+    v.params = vec4(1.0, 0.0, 0.0, 1.0);
     
-    // Trace through lens system to first bounce
-    for (uint i = 0; i < bounce1_idx && i < lens_interfaces.length(); ++i) {
-        LensInterface iface = lens_interfaces[i];
-        float t;
-        bool hit = false;
+    int T = 0;
+    int delta = 1;
+    int phase = 0;
+    int max_steps = num_lens * (1 + MAX_BOUNCES);
+    
+    for (int step = 0; step < max_steps; ++step) {
+        LensInterface F = fetchInterface(T);
+        bool reflect_here = phase < num_bounces && T == bounces[phase];
         
-        if (iface.is_flat > 0.5) {
-            hit = intersectPlane(current_pos, current_dir, iface.center, vec3(0, 0, 1), t);
-        } else {
-            hit = intersectSphere(current_pos, current_dir, iface.center, iface.radius, t);
+        Intersection i = (F.is_flat > 0.5) ? testFlat(r, F) : testSphere(r, F);
+        if (!i.hit) break;
+        r.pos = i.pos;
+        
+        if (T == sensor) {
+            v.position.xy = r.pos.xy / plate_size * vec2(backbuffer_size.y / backbuffer_size.x, 1.0);
+            return v;
         }
         
-        if (!hit) {
-            intensity = 0.0;
-            break;
+        float radius = length(r.pos.xy) / F.sa;
+        if (T == stop) {
+            v.position.zw = r.pos.xy / F.sa;
+        } else {
+            // Clipped rays keep going so the fragment stage can cut the patch smoothly
+            v.params.y = max(v.params.y, radius);
         }
         
-        current_pos += current_dir * t;
+        float n0 = r.dir.z > 0.0 ? F.n.x : F.n.z;
+        float n1 = F.n.y;
+        float n2 = r.dir.z > 0.0 ? F.n.z : F.n.x;
         
-        // Apply refraction/reflection (simplified)
-        if (i == bounce1_idx - 1) {
-            // First reflection
-            vec3 normal = normalize(current_pos - iface.center);
-            current_dir = reflect(current_dir, normal);
-            intensity *= fresnel(abs(dot(current_dir, normal)), iface.n.x, iface.n.z) * 0.1;
+        if (reflect_here) {
+            r.dir = reflect(r.dir, i.norm);
+            v.params.x *= fresnelAR(i.theta, wavelength, F.d1, n0, n1, n2);
+            delta = -delta;
+            ++phase;
+        } else if (n0 != n2) {
+            r.dir = refract(r.dir, i.norm, n0 / n2);
+            if (r.dir == vec3(0.0)) break; // total internal reflection
         }
+        
+        T += delta;
+        if (T < 0 || T >= num_lens) break;
+    }
+    
+    // Ray missed an interface or was totally reflected
+    v.params.x = 0.0;
+    return v;
+}
+
+// Light travels along the camera view (-z), the lens frame propagates along +z. The lens is
+// rotationally symmetric, so in the meridional frame the light is turned about the axis to
+// azimuth 0, where the patch is mirror-symmetric in y
+vec3 lensDirection(uint light_id) {
+    vec3 light_dir = lights[light_id].direction.xyz;
+    vec3 dir = normalize(vec3(light_dir.xy, -light_dir.z));
+    if (meridional) {
+        dir = vec3(length(dir.xy), 0.0, dir.z);
     }
+    return dir;
+}
+
+GhostVertex traceVertex(uint ghost_id, uint x, uint y, vec3 dir) {
+    // Collimated ray bundle covering the front element
+    vec2 grid = vec2(x, y) / float(patch_tessellation - 1) * 2.0 - 1.0;
+    Ray r;
+    r.pos = vec3(grid * spread * fetchInterface(0).sa, 0.0) - dir * (20.0 / dir.z);
+    r.dir = dir;
     
-    // Continue to second bounce
-    for (uint i = bounce1_idx; i < bounce2_idx && i < lens_interfaces.length(); ++i) {
-        LensInterface iface = lens_interfaces[i];
-        float t;
-        bool hit = false;
+    return traceGhost(r, ghost_data[ghost_id]);
+}
+
+void storeVertex(uint patch_id, uint x, uint y, GhostVertex v) {
+    uint vertex_idx = patch_id * uint(patch_tessellation * patch_tessellation) + y * uint(patch_tessellation) + x;
+    if (vertex_idx < vertex_data.length()) {
+        vertex_data[vertex_idx] = v;
+    }
+}
+
+// Stores a vertex and, in the meridional frame, its mirror image across the symmetry
+// plane; returns how many grid vertices it filled
+uint storeSymmetric(uint patch_id, uint x, uint y, GhostVertex v) {
+    storeVertex(patch_id, x, y, v);
+    uint mirror_y = uint(patch_tessellation) - 1u - y;
+    if (!meridional || mirror_y == y) {
+        return 1u;
+    }
+    v.position.yw = -v.position.yw;
+    storeVertex(patch_id, x, mirror_y, v);
+    return 2u;
+}
+
+// Vertices that can produce fragments: reached the sensor and stayed inside every aperture
+bool isLit(GhostVertex v) {
+    return v.params.x > 0.0 && v.params.y <= 1.0;
+}
+
+ivec2 quantizeBounds(vec2 position) {
+    return ivec2(clamp(position, vec2(-BOUNDS_LIMIT), vec2(BOUNDS_LIMIT)) * BOUNDS_SCALE);
+}
+
+#define MAX_AREA_GAIN 1024.0
+
+// Sensor positions of the workgroup's rays (xy in lens units, z = 1 when the ray arrived)
+shared vec3 s_sensor[256];
+
+vec3 sensorSample(GhostVertex v, bool in_range) {
+    if (!in_range || v.params.x <= 0.0) return vec3(0.0);
+    return vec3(v.position.xy * plate_size * vec2(backbuffer_size.x / backbuffer_size.y, 1.0), 1.0);
+}
+
+// Central difference when both grid neighbours are in shared memory, one-sided otherwise
+bool gridDerivative(vec3 center, uint prev, bool has_prev, uint next, bool has_next, out vec2 d) {
+    has_prev = has_prev && s_sensor[prev].z > 0.5;
+    has_next = has_next && s_sensor[next].z > 0.5;
+    d = vec2(0.0);
+    if (has_prev && has_next) {
+        d = (s_sensor[next].xy - s_sensor[prev].xy) * 0.5;
+    } else if (has_next) {
+        d = s_sensor[next].xy - center.xy;
+    } else if (has_prev) {
+        d = center.xy - s_sensor[prev].xy;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Ratio of a grid cell's beam cross-section at the entrance to its area on the sensor:
+// the irradiance gain of the ghost at this vertex
+float areaRatio(uint lane, uint left, bool has_left, uint right, bool has_right,
+                uint down, bool has_down, uint up, bool has_up, vec3 dir) {
+    vec3 center = s_sensor[lane];
+    vec2 du, dv;
+    if (center.z < 0.5 || !gridDerivative(center, left, has_left, right, has_right, du) ||
+        !gridDerivative(center, down, has_down, up, has_up, dv)) {
+        return 0.0;
+    }
+    
+    float h = 2.0 * spread * fetchInterface(0).sa / float(patch_tessellation - 1);
+    float entrance_area = h * h * abs(dir.z);
+    float sensor_area = abs(du.x * dv.y - du.y * dv.x);
+    return min(entrance_area / max(sensor_area, 1e-12), MAX_AREA_GAIN);
+}
+
+shared int s_bbox[4];
+shared uint s_energy;
+shared uint s_lit;
+
+void main() {
+    stageLensTable();
+    
+    uint p = uint(patch_tessellation);
+    uint lane = gl_LocalInvocationIndex;
+    
+    // A patch is one (light, ghost) pair, stored light by light. Meridional patches are mirror-
+    // symmetric, so only rows from p / 2 up are traced and the draw rotates them back by the
+    // light's azimuth
+    uint num_patches = GHOST_COUNT * uint(num_lights);
+    uint first_row = meridional ? p / 2u : 0u;
+    uint vertices_per_ghost = p * (p - first_row);
+    
+    if (persistent_threads) {
+        // Workgroups loop over 256-vertex chunks of the linearised (patch, vertex) space,
+        // so several tiny ghosts share one workgroup without idle lanes. A chunk may span
+        // patches, so lit vertices go straight to the global bounds.
+        uint group_size = gl_WorkGroupSize.x * gl_WorkGroupSize.y;
+        uint total_vertices = num_patches * vertices_per_ghost;
+        for (uint base = gl_WorkGroupID.x * group_size; base < total_vertices; base += gl_NumWorkGroups.x * group_size) {
+            uint index = base + lane;
+            bool in_range = index < total_vertices;
+            uint patch_id = in_range ? index / vertices_per_ghost : 0u;
+            uint v = index % vertices_per_ghost;
+            uint x = v % p;
+            uint y = first_row + v / p;
+            vec3 dir = lensDirection(patch_id / GHOST_COUNT);
+            
+            GhostVertex vertex;
+            if (in_range) {
+                vertex = traceVertex(patch_id % GHOST_COUNT, x, y, dir);
+            }
+            s_sensor[lane] = sensorSample(vertex, in_range);
+            barrier();
+            
+            if (in_range) {
+                // A chunk holds whole rows or row fragments, so the row neighbours are adjacent
+                // lanes and the column neighbours are p lanes away when they fall in the chunk
+                vertex.params.z = areaRatio(lane, lane - 1u, x > 0u && lane > 0u, lane + 1u, x + 1u < p && lane + 1u < group_size,
+                                            lane - p, y > first_row && lane >= p, lane + p, y + 1u < p && lane + p < group_size, dir);
+                uint copies = storeSymmetric(patch_id, x, y, vertex);
+                
+                if (isLit(vertex)) {
+                    // Quantisation truncates toward zero, so the mirrored bound is exact
+                    ivec2 q = quantizeBounds(vertex.position.xy);
+                    int mirror_y = copies > 1u ? -q.y : q.y;
+                    atomicMin(ghost_bounds[patch_id].bbox.x, q.x);
+                    atomicMin(ghost_bounds[patch_id].bbox.y, min(q.y, mirror_y));
+                    atomicMax(ghost_bounds[patch_id].bbox.z, q.x);
+                    atomicMax(ghost_bounds[patch_id].bbox.w, max(q.y, mirror_y));
+                    atomicAdd(ghost_bounds[patch_id].stats.x, copies * uint(min(vertex.params.x * vertex.params.z, 1.0) * energy_scale + 0.5));
+                    atomicAdd(ghost_bounds[patch_id].stats.y, copies);
+                }
+            }
+            barrier(); // s_sensor is reused by the next chunk
+        }
+    } else {
+        // One workgroup per (tile, patch): xy select the 16x16 tile, z selects the patch.
+        // The whole tile belongs to one patch, so bounds are reduced in shared memory first
+        // and published with a single set of global atomics per workgroup.
+        uint x = gl_GlobalInvocationID.x;
+        uint y = first_row + gl_GlobalInvocationID.y;
+        uint lx = gl_LocalInvocationID.x;
+        uint ly = gl_LocalInvocationID.y;
+        uint patch_id = gl_WorkGroupID.z;
+        bool in_range = x < p && y < p && patch_id < num_patches;
         
-        if (iface.is_flat > 0.5) {
-            hit = intersectPlane(current_pos, current_dir, iface.center, vec3(0, 0, 1), t);
-        } else {
-            hit = intersectSphere(current_pos, current_dir, iface.center, iface.radius, t);
+        if (lane == 0u) {
+            s_bbox[0] = s_bbox[1] = 0x7FFFFFFF;
+            s_bbox[2] = s_bbox[3] = -0x7FFFFFFF;
+            s_energy = 0u;
+            s_lit = 0u;
         }
         
-        if (!hit) {
-            intensity = 0.0;
-            break;
+        vec3 dir = lensDirection(min(patch_id, num_patches - 1u) / GHOST_COUNT);
+        GhostVertex vertex;
+        if (in_range) {
+            vertex = traceVertex(patch_id % GHOST_COUNT, x, y, dir);
         }
+        s_sensor[lane] = sensorSample(vertex, in_range);
+        barrier();
         
-        current_pos += current_dir * t;
+        if (in_range) {
+            // Neighbours outside the tile are not resident, so tile edges use one-sided differences
+            uint width = gl_WorkGroupSize.x;
+            vertex.params.z = areaRatio(lane, lane - 1u, x > 0u && lx > 0u, lane + 1u, x + 1u < p && lx + 1u < width,
+                                        lane - width, y > first_row && ly > 0u, lane + width, y + 1u < p && ly + 1u < gl_WorkGroupSize.y, dir);
+            uint copies = storeSymmetric(patch_id, x, y, vertex);
+            
+            if (isLit(vertex)) {
+                ivec2 q = quantizeBounds(vertex.position.xy);
+                int mirror_y = copies > 1u ? -q.y : q.y;
+                atomicMin(s_bbox[0], q.x);
+                atomicMin(s_bbox[1], min(q.y, mirror_y));
+                atomicMax(s_bbox[2], q.x);
+                atomicMax(s_bbox[3], max(q.y, mirror_y));
+                atomicAdd(s_energy, copies * uint(min(vertex.params.x * vertex.params.z, 1.0) * energy_scale + 0.5));
+                atomicAdd(s_lit, copies);
+            }
+        }
+        barrier();
         
-        // Apply refraction/reflection (simplified)
-        if (i == bounce2_idx - 1) {
-            // Second reflection
-            vec3 normal = normalize(current_pos - iface.center);
-            current_dir = reflect(current_dir, normal);
-            intensity *= fresnel(abs(dot(current_dir, normal)), iface.n.x, iface.n.z) * 0.1;
+        if (lane == 0u && s_lit > 0u && patch_id < num_patches) {
+            atomicMin(ghost_bounds[patch_id].bbox.x, s_bbox[0]);
+            atomicMin(ghost_bounds[patch_id].bbox.y, s_bbox[1]);
+            atomicMax(ghost_bounds[patch_id].bbox.z, s_bbox[2]);
+            atomicMax(ghost_bounds[patch_id].bbox.w, s_bbox[3]);
+            atomicAdd(ghost_bounds[patch_id].stats.x, s_energy);
+            atomicAdd(ghost_bounds[patch_id].stats.y, s_lit);
         }
     }
-    
-    // Project final ray to screen
-    vec2 screen_pos = current_pos.xy / backbuffer_size * 2.0 - 1.0;
-    
-    // Store vertex data
-    uint vertex_idx = ghost_id * 256 + local_y * 16 + local_x;
-    if (vertex_idx < vertex_data.length()) {
-        vertex_data[vertex_idx] = vec4(screen_pos, intensity, 1.0);
-    }
-}
\ No newline at end of file
+}
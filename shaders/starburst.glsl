@@ -8,14 +8,7 @@ uniform float time;
 uniform vec3 light_dir;
 uniform vec2 backbuffer_size;
 
-vec3 temperatureToColor(float temp) {
-    float t = temp / 6000.0;
-    vec3 color;
-    color.r = clamp(1.0 + 0.1 * (t - 1.0), 0.6, 1.0);
-    color.g = clamp(0.9 + 0.05 * (t - 1.0), 0.8, 1.0);
-    color.b = clamp(0.8 + 0.2 * (1.0 - t), 0.5, 1.0);
-    return color;
-}
+#include "common/color.glsl"
 
 void main() {
     vec2 centered_uv = (uv - 0.5) * 2.0;
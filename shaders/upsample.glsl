@@ -0,0 +1,44 @@
+#version 330 core
+
+in vec2 uv;
+out vec4 fragColor;
+
+uniform sampler2D source_texture;
+uniform vec2 source_size;
+
+// Catmull-Rom reconstruction of a reduced-resolution flare layer. The 4x4 kernel is
+// evaluated in 9 bilinear taps by merging the two inner weights of each axis into one
+// tap placed between the texels (both inner weights are positive)
+void main() {
+    vec2 sample_pos = uv * source_size;
+    vec2 tex_pos1 = floor(sample_pos - 0.5) + 0.5;
+    vec2 f = sample_pos - tex_pos1;
+    
+    vec2 w0 = f * (-0.5 + f * (1.0 - 0.5 * f));
+    vec2 w1 = 1.0 + f * f * (-2.5 + 1.5 * f);
+    vec2 w2 = f * (0.5 + f * (2.0 - 1.5 * f));
+    vec2 w3 = f * f * (-0.5 + 0.5 * f);
+    
+    vec2 w12 = w1 + w2;
+    vec2 offset12 = w2 / w12;
+    
+    vec2 tex_pos0 = (tex_pos1 - 1.0) / source_size;
+    vec2 tex_pos3 = (tex_pos1 + 2.0) / source_size;
+    vec2 tex_pos12 = (tex_pos1 + offset12) / source_size;
+    
+    vec4 result = vec4(0.0);
+    result += textureLod(source_texture, vec2(tex_pos0.x, tex_pos0.y), 0.0) * w0.x * w0.y;
+    result += textureLod(source_texture, vec2(tex_pos12.x, tex_pos0.y), 0.0) * w12.x * w0.y;
+    result += textureLod(source_texture, vec2(tex_pos3.x, tex_pos0.y), 0.0) * w3.x * w0.y;
+    
+    result += textureLod(source_texture, vec2(tex_pos0.x, tex_pos12.y), 0.0) * w0.x * w12.y;
+    result += textureLod(source_texture, vec2(tex_pos12.x, tex_pos12.y), 0.0) * w12.x * w12.y;
+    result += textureLod(source_texture, vec2(tex_pos3.x, tex_pos12.y), 0.0) * w3.x * w12.y;
+    
+    result += textureLod(source_texture, vec2(tex_pos0.x, tex_pos3.y), 0.0) * w0.x * w3.y;
+    result += textureLod(source_texture, vec2(tex_pos12.x, tex_pos3.y), 0.0) * w12.x * w3.y;
+    result += textureLod(source_texture, vec2(tex_pos3.x, tex_pos3.y), 0.0) * w3.x * w3.y;
+    
+    // The negative lobes ring around hard ghost edges; radiance cannot go below zero
+    fragColor = max(result, vec4(0.0));
+}